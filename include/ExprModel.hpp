@@ -0,0 +1,974 @@
+#ifndef EXPRMODEL_HPP
+#define EXPRMODEL_HPP
+
+#include "Model.hpp"
+#include "algorithm"
+#include "cmath"
+#include "cstdint"
+#include "cstdlib"
+#include "cstring"
+#include "limits"
+#include "map"
+#include "stdexcept"
+#include "string"
+#include "tuple"
+#include "unordered_map"
+#include "vector"
+#include "fmt/core.h"
+
+namespace QUtil {
+
+    namespace expr {
+
+        /// ExpMul (exp(a * b)) only appears on compiled tapes, never in a Graph
+        enum class Op : uint8_t {
+            Const, Var, Neg, Add, Sub, Mul, Div, Pow, Exp, Log, Sqrt, Sin, Cos, Lt, Le, Gt, Ge, Select, ExpMul
+        };
+
+        /// scalar semantics of every op, used for constant folding and the single point path
+        /// \param op operator
+        /// \param a first operand (condition for Select)
+        /// \param b second operand (then branch for Select)
+        /// \param c third operand (else branch for Select)
+        inline double apply(const Op op, const double a, const double b, const double c) {
+            switch (op) {
+                case Op::Neg:
+                    return -a;
+                case Op::Add:
+                    return a + b;
+                case Op::Sub:
+                    return a - b;
+                case Op::Mul:
+                    return a * b;
+                case Op::Div:
+                    return a / b;
+                case Op::Pow:
+                    return pow(a, b);
+                case Op::Exp:
+                    return exp(a);
+                case Op::Log:
+                    return log(a);
+                case Op::Sqrt:
+                    return sqrt(a);
+                case Op::Sin:
+                    return sin(a);
+                case Op::Cos:
+                    return cos(a);
+                case Op::Lt:
+                    return a < b;
+                case Op::Le:
+                    return a <= b;
+                case Op::Gt:
+                    return a > b;
+                case Op::Ge:
+                    return a >= b;
+                case Op::Select:
+                    return a != 0 ? b : c;
+                case Op::ExpMul:
+                    return exp(a * b);
+                default:
+                    throw std::logic_error("expr: op has no scalar semantics");
+            }
+        }
+
+        /// flat register tape, every instruction writes its own register
+        class Tape {
+        public:
+            /// number of points evaluated per interpreter sweep
+            static constexpr size_t block = 64;
+
+            struct Instr {
+                Op op;
+                uint32_t dst, a, b, c;
+            };
+
+            /// register files for the block sweep and the single point path
+            struct Workspace {
+                std::vector<double> lanes, scalar;
+            };
+
+            size_t n_outputs() const { return outputs.size(); }
+
+            size_t n_registers() const { return n_reg; }
+
+            size_t n_instructions() const { return code.size(); }
+
+            /// register files with constants preloaded, shared by every tape lowered in the same Graph::compile
+            Workspace workspace() const {
+                Workspace work{std::vector<double>(std::max<size_t>(n_reg, 1) * block),
+                               std::vector<double>(std::max<size_t>(n_reg, 1))};
+                for (auto &[r, v]: constants) {
+                    std::fill_n(&work.lanes[r * block], block, v);
+                    work.scalar[r] = v;
+                }
+                return work;
+            }
+
+            /// evaluate all outputs over a batch of points
+            /// \param x points
+            /// \param n number of points
+            /// \param out n * n_outputs() values, row-major by point
+            /// \param work register files from workspace()
+            void evaluate(const double *x, const size_t n, double *out, Workspace &work) const {
+                if (n == 1) {
+                    evaluate_one(*x, out, work.scalar.data());
+                    return;
+                }
+                const size_t n_out = outputs.size();
+                double *reg = work.lanes.data();
+                for (size_t start = 0; start < n; start += block) {
+                    const size_t len = std::min(block, n - start);
+                    if (has_var)
+                        std::copy_n(x + start, len, reg + var_reg * block);
+                    for (auto &ins: code) {
+                        double *d = reg + ins.dst * block;
+                        const double *a = reg + ins.a * block;
+                        const double *b = reg + ins.b * block;
+                        const double *c = reg + ins.c * block;
+                        switch (ins.op) {
+                            case Op::Neg:
+                                for (size_t i = 0; i < len; ++i) d[i] = -a[i];
+                                break;
+                            case Op::Add:
+                                for (size_t i = 0; i < len; ++i) d[i] = a[i] + b[i];
+                                break;
+                            case Op::Sub:
+                                for (size_t i = 0; i < len; ++i) d[i] = a[i] - b[i];
+                                break;
+                            case Op::Mul:
+                                for (size_t i = 0; i < len; ++i) d[i] = a[i] * b[i];
+                                break;
+                            case Op::Div:
+                                for (size_t i = 0; i < len; ++i) d[i] = a[i] / b[i];
+                                break;
+                            case Op::Pow:
+                                for (size_t i = 0; i < len; ++i) d[i] = pow(a[i], b[i]);
+                                break;
+                            case Op::Exp:
+                                for (size_t i = 0; i < len; ++i) d[i] = exp(a[i]);
+                                break;
+                            case Op::ExpMul:
+                                for (size_t i = 0; i < len; ++i) d[i] = exp(a[i] * b[i]);
+                                break;
+                            case Op::Log:
+                                for (size_t i = 0; i < len; ++i) d[i] = log(a[i]);
+                                break;
+                            case Op::Sqrt:
+                                for (size_t i = 0; i < len; ++i) d[i] = sqrt(a[i]);
+                                break;
+                            case Op::Sin:
+                                for (size_t i = 0; i < len; ++i) d[i] = sin(a[i]);
+                                break;
+                            case Op::Cos:
+                                for (size_t i = 0; i < len; ++i) d[i] = cos(a[i]);
+                                break;
+                            case Op::Lt:
+                                for (size_t i = 0; i < len; ++i) d[i] = a[i] < b[i];
+                                break;
+                            case Op::Le:
+                                for (size_t i = 0; i < len; ++i) d[i] = a[i] <= b[i];
+                                break;
+                            case Op::Gt:
+                                for (size_t i = 0; i < len; ++i) d[i] = a[i] > b[i];
+                                break;
+                            case Op::Ge:
+                                for (size_t i = 0; i < len; ++i) d[i] = a[i] >= b[i];
+                                break;
+                            case Op::Select:
+                                for (size_t i = 0; i < len; ++i) d[i] = a[i] != 0 ? b[i] : c[i];
+                                break;
+                            default:
+                                break;
+                        }
+                    }
+                    for (size_t i = 0; i < len; ++i) {
+                        for (size_t o = 0; o < n_out; ++o) {
+                            out[(start + i) * n_out + o] = reg[outputs[o] * block + i];
+                        }
+                    }
+                }
+            }
+
+        private:
+            friend class Graph;
+            friend class Program;
+
+            /// scalar sweep, a block sweep of one lane pays the loop setup of every instruction
+            void evaluate_one(const double x, double *out, double *reg) const {
+                run_one(x, reg);
+                for (size_t o = 0; o < outputs.size(); ++o) {
+                    out[o] = reg[outputs[o]];
+                }
+            }
+
+            void run_one(const double x, double *reg) const {
+                if (has_var)
+                    reg[var_reg] = x;
+                if (!code.empty())
+                    steps[static_cast<size_t>(code.front().op)](code.data(), code.data() + code.size(), reg);
+            }
+
+            using Step = void (*)(const Instr *ip, const Instr *end, double *reg);
+
+            /// one handler per op, each ends in its own call to the next handler; optimizing compilers emit
+            /// that tail call as a jump, so every op gets its own well predicted indirect branch
+            template<Op op>
+            static void step(const Instr *ip, const Instr *end, double *reg) {
+                reg[ip->dst] = apply(op, reg[ip->a], reg[ip->b], reg[ip->c]);
+                if (++ip != end)
+                    steps[static_cast<size_t>(ip->op)](ip, end, reg);
+            }
+
+            static constexpr Step steps[] = {
+                    step<Op::Const>, step<Op::Var>, step<Op::Neg>, step<Op::Add>, step<Op::Sub>, step<Op::Mul>,
+                    step<Op::Div>, step<Op::Pow>, step<Op::Exp>, step<Op::Log>, step<Op::Sqrt>, step<Op::Sin>,
+                    step<Op::Cos>, step<Op::Lt>, step<Op::Le>, step<Op::Gt>, step<Op::Ge>, step<Op::Select>,
+                    step<Op::ExpMul>};
+
+            std::vector<Instr> code;
+            std::vector<std::pair<uint32_t, double>> constants;
+            std::vector<uint32_t> outputs;
+            uint32_t n_reg{}, var_reg{};
+            bool has_var{};
+        };
+
+        /// hash-consed expression DAG, identical subexpressions share one node
+        class Graph {
+        public:
+            uint32_t constant(const double v) {
+                return make(Op::Const, 0, 0, 0, v);
+            }
+
+            uint32_t variable() {
+                return make(Op::Var, 0, 0, 0, 0);
+            }
+
+            uint32_t make(const Op op, uint32_t a, uint32_t b = 0, uint32_t c = 0, const double value = 0) {
+                if (op != Op::Const && op != Op::Var) {
+                    if (auto folded = fold(op, a, b, c); folded != npos)
+                        return folded;
+                }
+                uint64_t bits = 0;
+                std::memcpy(&bits, &value, sizeof(bits));
+                auto key = std::make_tuple(op, a, b, c, bits);
+                auto it = index.find(key);
+                if (it != index.end())
+                    return it->second;
+                auto id = static_cast<uint32_t>(nodes.size());
+                nodes.push_back(Node{op, a, b, c, value});
+                index.emplace(key, id);
+                return id;
+            }
+
+            /// forward-mode derivative w.r.t. the variable, built from shared nodes
+            /// \param id node to differentiate
+            /// \param memo derivative node of each already differentiated node
+            uint32_t derivative(const uint32_t id, std::unordered_map<uint32_t, uint32_t> &memo) {
+                // derivatives carry no bitwise guarantee, so constant factors may be merged
+                reassociate = true;
+                auto d = differentiate(id, memo);
+                reassociate = false;
+                return d;
+            }
+
+            /// comparison nodes reachable from outputs, in topological order
+            std::vector<uint32_t> comparisons(const std::vector<uint32_t> &outputs) const {
+                auto mark = live(outputs);
+                std::vector<uint32_t> result;
+                for (uint32_t i = 0; i < nodes.size(); ++i) {
+                    auto op = nodes[i].op;
+                    if (mark[i] && (op == Op::Lt || op == Op::Le || op == Op::Gt || op == Op::Ge))
+                        result.push_back(i);
+                }
+                return result;
+            }
+
+            /// rebuild id with the comparisons in known replaced by constants,
+            /// selects on a known condition keep only the taken branch
+            uint32_t specialize(const uint32_t id, const std::unordered_map<uint32_t, bool> &known,
+                                std::unordered_map<uint32_t, uint32_t> &memo) {
+                auto it = memo.find(id);
+                if (it != memo.end())
+                    return it->second;
+                const Node n = nodes[id];
+                uint32_t s;
+                if (auto k = known.find(id); k != known.end()) {
+                    s = constant(k->second);
+                } else if (n.op == Op::Const || n.op == Op::Var) {
+                    s = id;
+                } else if (n.op == Op::Select) {
+                    auto cond = specialize(n.a, known, memo);
+                    if (nodes[cond].op == Op::Const)
+                        s = specialize(nodes[cond].value != 0 ? n.b : n.c, known, memo);
+                    else
+                        s = make(Op::Select, cond, specialize(n.b, known, memo), specialize(n.c, known, memo));
+                } else {
+                    int k = arity(n.op);
+                    auto a = specialize(n.a, known, memo);
+                    auto b = k < 2 ? 0 : specialize(n.b, known, memo);
+                    s = make(n.op, a, b);
+                }
+                memo.emplace(id, s);
+                return s;
+            }
+
+            /// lower the nodes reachable from each output set to one tape per set,
+            /// all tapes share the register numbering so one workspace serves them all
+            std::vector<Tape> compile(const std::vector<std::vector<uint32_t>> &output_sets) const {
+                std::vector<std::vector<bool>> marks;
+                std::vector<bool> any(nodes.size(), false);
+                for (auto &outputs: output_sets) {
+                    marks.push_back(live(outputs));
+                    for (size_t i = 0; i < nodes.size(); ++i) {
+                        if (marks.back()[i]) any[i] = true;
+                    }
+                }
+                Tape shared;
+                std::vector<uint32_t> reg(nodes.size(), 0);
+                for (size_t i = 0; i < nodes.size(); ++i) {
+                    if (!any[i]) continue;
+                    reg[i] = shared.n_reg++;
+                    if (nodes[i].op == Op::Const)
+                        shared.constants.emplace_back(reg[i], nodes[i].value);
+                    else if (nodes[i].op == Op::Var)
+                        shared.var_reg = reg[i];
+                }
+                std::vector<Tape> tapes;
+                for (size_t t = 0; t < output_sets.size(); ++t) {
+                    Tape tape = shared;
+                    // exp of a product used nowhere else in this tape runs as one ExpMul instruction
+                    std::vector<uint32_t> uses(nodes.size(), 0);
+                    for (auto o: output_sets[t]) ++uses[o];
+                    for (size_t i = 0; i < nodes.size(); ++i) {
+                        if (!marks[t][i]) continue;
+                        auto k = arity(nodes[i].op);
+                        if (k > 0) ++uses[nodes[i].a];
+                        if (k > 1) ++uses[nodes[i].b];
+                        if (k > 2) ++uses[nodes[i].c];
+                    }
+                    std::vector<bool> fused(nodes.size(), false);
+                    for (size_t i = 0; i < nodes.size(); ++i) {
+                        if (marks[t][i] && nodes[i].op == Op::Exp && nodes[nodes[i].a].op == Op::Mul &&
+                            uses[nodes[i].a] == 1)
+                            fused[nodes[i].a] = true;
+                    }
+                    for (size_t i = 0; i < nodes.size(); ++i) {
+                        if (!marks[t][i] || fused[i]) continue;
+                        auto &n = nodes[i];
+                        if (n.op == Op::Var) {
+                            tape.has_var = true;
+                        } else if (n.op == Op::Exp && fused[n.a]) {
+                            auto &m = nodes[n.a];
+                            tape.code.push_back(Tape::Instr{Op::ExpMul, reg[i], reg[m.a], reg[m.b], 0});
+                        } else if (n.op != Op::Const) {
+                            tape.code.push_back(Tape::Instr{n.op, reg[i], reg[n.a], reg[n.b], reg[n.c]});
+                        }
+                    }
+                    for (auto o: output_sets[t]) tape.outputs.push_back(reg[o]);
+                    tapes.push_back(std::move(tape));
+                }
+                return tapes;
+            }
+
+        private:
+            struct Node {
+                Op op;
+                uint32_t a, b, c;
+                double value;
+            };
+
+            static constexpr uint32_t npos = std::numeric_limits<uint32_t>::max();
+
+            uint32_t differentiate(const uint32_t id, std::unordered_map<uint32_t, uint32_t> &memo) {
+                auto it = memo.find(id);
+                if (it != memo.end())
+                    return it->second;
+                const Node n = nodes[id];
+                uint32_t d{};
+                switch (n.op) {
+                    case Op::Const:
+                    case Op::Lt:
+                    case Op::Le:
+                    case Op::Gt:
+                    case Op::Ge:
+                        d = constant(0);
+                        break;
+                    case Op::Var:
+                        d = constant(1);
+                        break;
+                    case Op::Neg:
+                        d = make(Op::Neg, differentiate(n.a, memo));
+                        break;
+                    case Op::Add:
+                    case Op::Sub:
+                        d = make(n.op, differentiate(n.a, memo), differentiate(n.b, memo));
+                        break;
+                    case Op::Mul:
+                        d = make(Op::Add, make(Op::Mul, differentiate(n.a, memo), n.b),
+                                 make(Op::Mul, n.a, differentiate(n.b, memo)));
+                        break;
+                    case Op::Div:
+                        // (a / b)' = (a' - (a / b) * b') / b
+                        d = make(Op::Div, make(Op::Sub, differentiate(n.a, memo),
+                                               make(Op::Mul, id, differentiate(n.b, memo))), n.b);
+                        break;
+                    case Op::Pow:
+                        if (nodes[n.b].op == Op::Const) {
+                            auto e = nodes[n.b].value;
+                            d = make(Op::Mul, make(Op::Mul, n.b, make(Op::Pow, n.a, constant(e - 1))),
+                                     differentiate(n.a, memo));
+                        } else {
+                            d = make(Op::Mul, id, make(Op::Add, make(Op::Mul, differentiate(n.b, memo), make(Op::Log, n.a)),
+                                                       make(Op::Div, make(Op::Mul, n.b, differentiate(n.a, memo)), n.a)));
+                        }
+                        break;
+                    case Op::Exp:
+                        d = make(Op::Mul, id, differentiate(n.a, memo));
+                        break;
+                    case Op::Log:
+                        d = make(Op::Div, differentiate(n.a, memo), n.a);
+                        break;
+                    case Op::Sqrt:
+                        d = make(Op::Div, differentiate(n.a, memo), make(Op::Mul, constant(2), id));
+                        break;
+                    case Op::Sin:
+                        d = make(Op::Mul, make(Op::Cos, n.a), differentiate(n.a, memo));
+                        break;
+                    case Op::Cos:
+                        d = make(Op::Neg, make(Op::Mul, make(Op::Sin, n.a), differentiate(n.a, memo)));
+                        break;
+                    case Op::Select:
+                        d = make(Op::Select, n.a, differentiate(n.b, memo), differentiate(n.c, memo));
+                        break;
+                    case Op::ExpMul:
+                        throw std::logic_error("expr: fused op in expression graph");
+                }
+                memo.emplace(id, d);
+                return d;
+            }
+
+            /// nodes reachable from outputs
+            std::vector<bool> live(const std::vector<uint32_t> &outputs) const {
+                std::vector<bool> mark(nodes.size(), false);
+                for (auto o: outputs) mark[o] = true;
+                // node ids are topologically ordered, so one backward sweep marks every operand
+                for (size_t i = nodes.size(); i-- > 0;) {
+                    if (!mark[i]) continue;
+                    auto &n = nodes[i];
+                    switch (arity(n.op)) {
+                        case 3:
+                            mark[n.c] = true;
+                            [[fallthrough]];
+                        case 2:
+                            mark[n.b] = true;
+                            [[fallthrough]];
+                        case 1:
+                            mark[n.a] = true;
+                            break;
+                        default:
+                            break;
+                    }
+                }
+                return mark;
+            }
+
+            static int arity(const Op op) {
+                switch (op) {
+                    case Op::Const:
+                    case Op::Var:
+                        return 0;
+                    case Op::Neg:
+                    case Op::Exp:
+                    case Op::Log:
+                    case Op::Sqrt:
+                    case Op::Sin:
+                    case Op::Cos:
+                        return 1;
+                    case Op::Select:
+                        return 3;
+                    default:
+                        return 2;
+                }
+            }
+
+            /// split a product with a constant factor into (other factor, constant), npos if it is not one
+            std::pair<uint32_t, double> split_const(const uint32_t id) const {
+                auto &n = nodes[id];
+                if (n.op == Op::Mul && nodes[n.a].op == Op::Const) return {n.b, nodes[n.a].value};
+                if (n.op == Op::Mul && nodes[n.b].op == Op::Const) return {n.a, nodes[n.b].value};
+                return {npos, 0};
+            }
+
+            bool is_const(const uint32_t id, const double v) const {
+                return nodes[id].op == Op::Const && nodes[id].value == v;
+            }
+
+            /// constant folding and algebraic identities, exact for finite operands except that
+            /// a * 0 folds to +0 and 0 - b to -b, so the sign of a zero result may differ,
+            /// and that constant factors are merged while building derivatives
+            uint32_t fold(const Op op, const uint32_t a, const uint32_t b, const uint32_t c) {
+                int k = arity(op);
+                bool all_const = nodes[a].op == Op::Const && (k < 2 || nodes[b].op == Op::Const) &&
+                                 (k < 3 || nodes[c].op == Op::Const);
+                if (all_const)
+                    return constant(apply(op, nodes[a].value, k < 2 ? 0 : nodes[b].value, k < 3 ? 0 : nodes[c].value));
+                switch (op) {
+                    case Op::Neg:
+                        if (nodes[a].op == Op::Neg) return nodes[a].a;
+                        // negation is exact, so it moves into a constant factor for free
+                        if (nodes[a].op == Op::Mul && nodes[nodes[a].a].op == Op::Const)
+                            return make(Op::Mul, constant(-nodes[nodes[a].a].value), nodes[a].b);
+                        if (nodes[a].op == Op::Mul && nodes[nodes[a].b].op == Op::Const)
+                            return make(Op::Mul, nodes[a].a, constant(-nodes[nodes[a].b].value));
+                        break;
+                    case Op::Add:
+                        if (is_const(a, 0)) return b;
+                        if (is_const(b, 0)) return a;
+                        if (nodes[b].op == Op::Neg) return make(Op::Sub, a, nodes[b].a);
+                        if (nodes[a].op == Op::Neg) return make(Op::Sub, b, nodes[a].a);
+                        break;
+                    case Op::Sub:
+                        if (is_const(b, 0)) return a;
+                        if (is_const(a, 0)) return make(Op::Neg, b);
+                        if (nodes[b].op == Op::Neg) return make(Op::Add, a, nodes[b].a);
+                        break;
+                    case Op::Mul:
+                        if (is_const(a, 0) || is_const(b, 0)) return constant(0);
+                        if (is_const(a, 1)) return b;
+                        if (is_const(b, 1)) return a;
+                        if (is_const(a, -1)) return make(Op::Neg, b);
+                        if (is_const(b, -1)) return make(Op::Neg, a);
+                        if (reassociate && (nodes[a].op == Op::Const || nodes[b].op == Op::Const)) {
+                            auto [k, y] = nodes[a].op == Op::Const ? std::make_pair(nodes[a].value, b)
+                                                                   : std::make_pair(nodes[b].value, a);
+                            auto [other, c] = split_const(y);
+                            if (other != npos) return make(Op::Mul, other, constant(k * c));
+                        }
+                        if (nodes[a].op == Op::Const && nodes[b].op == Op::Neg)
+                            return make(Op::Mul, constant(-nodes[a].value), nodes[b].a);
+                        if (nodes[b].op == Op::Const && nodes[a].op == Op::Neg)
+                            return make(Op::Mul, nodes[a].a, constant(-nodes[b].value));
+                        break;
+                    case Op::Div:
+                        // 0 / b is left alone, it is NaN at b == 0
+                        if (is_const(b, 1)) return a;
+                        break;
+                    case Op::Pow:
+                        if (is_const(b, 1)) return a;
+                        break;
+                    case Op::Select:
+                        if (b == c) return b;
+                        if (nodes[a].op == Op::Const) return nodes[a].value != 0 ? b : c;
+                        break;
+                    default:
+                        break;
+                }
+                return npos;
+            }
+
+            std::vector<Node> nodes;
+            bool reassociate{};
+            std::map<std::tuple<Op, uint32_t, uint32_t, uint32_t, uint64_t>, uint32_t> index;
+        };
+
+        /// recursive descent parser for
+        /// expr    := compare ('?' expr ':' expr)?
+        /// compare := sum (('<' | '<=' | '>' | '>=') sum)?
+        /// sum     := product (('+' | '-') product)*
+        /// product := unary (('*' | '/') unary)*
+        /// unary   := ('-' | '+') unary | power
+        /// power   := primary ('^' unary)?
+        /// primary := number | name | func '(' expr ')' | '(' expr ')'
+        class Parser {
+        public:
+            Parser(Graph &graph, std::string var, const std::map<std::string, double> &params)
+                    : graph(graph), var(std::move(var)), params(params) {}
+
+            uint32_t parse(const std::string &source) {
+                s = source;
+                pos = 0;
+                auto id = expr();
+                skip();
+                if (pos != s.size())
+                    error("unexpected character");
+                return id;
+            }
+
+        private:
+            [[noreturn]] void error(const std::string &msg) const {
+                throw std::invalid_argument(fmt::format("expr: {} at {} in \"{}\"", msg, pos, s));
+            }
+
+            void skip() {
+                while (pos < s.size() && isspace(static_cast<unsigned char>(s[pos]))) ++pos;
+            }
+
+            bool accept(const char *token) {
+                skip();
+                auto len = strlen(token);
+                if (s.compare(pos, len, token) == 0) {
+                    pos += len;
+                    return true;
+                }
+                return false;
+            }
+
+            void expect(const char *token) {
+                if (!accept(token))
+                    error(fmt::format("expected '{}'", token));
+            }
+
+            uint32_t expr() {
+                auto cond = compare();
+                if (!accept("?"))
+                    return cond;
+                auto then_ = expr();
+                expect(":");
+                auto else_ = expr();
+                return graph.make(Op::Select, cond, then_, else_);
+            }
+
+            uint32_t compare() {
+                auto lhs = sum();
+                if (accept("<=")) return graph.make(Op::Le, lhs, sum());
+                if (accept(">=")) return graph.make(Op::Ge, lhs, sum());
+                if (accept("<")) return graph.make(Op::Lt, lhs, sum());
+                if (accept(">")) return graph.make(Op::Gt, lhs, sum());
+                return lhs;
+            }
+
+            uint32_t sum() {
+                auto lhs = product();
+                while (true) {
+                    if (accept("+")) lhs = graph.make(Op::Add, lhs, product());
+                    else if (accept("-")) lhs = graph.make(Op::Sub, lhs, product());
+                    else return lhs;
+                }
+            }
+
+            uint32_t product() {
+                auto lhs = unary();
+                while (true) {
+                    if (accept("*")) lhs = graph.make(Op::Mul, lhs, unary());
+                    else if (accept("/")) lhs = graph.make(Op::Div, lhs, unary());
+                    else return lhs;
+                }
+            }
+
+            uint32_t unary() {
+                if (accept("-")) return graph.make(Op::Neg, unary());
+                if (accept("+")) return unary();
+                return power();
+            }
+
+            uint32_t power() {
+                auto base = primary();
+                if (accept("^")) return graph.make(Op::Pow, base, unary());
+                return base;
+            }
+
+            uint32_t primary() {
+                skip();
+                if (pos == s.size())
+                    error("unexpected end");
+                if (accept("(")) {
+                    auto id = expr();
+                    expect(")");
+                    return id;
+                }
+                char ch = s[pos];
+                if (isdigit(static_cast<unsigned char>(ch)) || ch == '.') {
+                    char *end = nullptr;
+                    double v = strtod(s.c_str() + pos, &end);
+                    pos = end - s.c_str();
+                    return graph.constant(v);
+                }
+                if (!isalpha(static_cast<unsigned char>(ch)) && ch != '_')
+                    error("unexpected character");
+                size_t begin = pos;
+                while (pos < s.size() && (isalnum(static_cast<unsigned char>(s[pos])) || s[pos] == '_')) ++pos;
+                auto name = s.substr(begin, pos - begin);
+                if (name == var)
+                    return graph.variable();
+                if (auto it = params.find(name); it != params.end())
+                    return graph.constant(it->second);
+                static const std::map<std::string, Op> functions{
+                        {"exp",  Op::Exp},
+                        {"log",  Op::Log},
+                        {"sqrt", Op::Sqrt},
+                        {"sin",  Op::Sin},
+                        {"cos",  Op::Cos}};
+                auto f = functions.find(name);
+                if (f == functions.end())
+                    error(fmt::format("unknown name '{}'", name));
+                expect("(");
+                auto arg = expr();
+                expect(")");
+                return graph.make(f->second, arg);
+            }
+
+            Graph &graph;
+            std::string var;
+            const std::map<std::string, double> &params;
+            std::string s;
+            size_t pos{};
+        };
+
+        /// tapes specialized for every outcome of the comparisons in piecewise expressions,
+        /// a point only runs the branches its piece selects
+        class Program {
+        public:
+            /// more comparisons than this keep the selects on a single tape
+            static constexpr size_t max_conditions = 8;
+            /// points classified per sweep of the condition tape
+            static constexpr size_t chunk = 16 * Tape::block;
+
+            struct Workspace {
+                Tape::Workspace regs;
+                std::vector<double> cond, x, out;
+                std::vector<uint32_t> piece, index;
+            };
+
+            Program(Tape conditions, std::vector<Tape> pieces)
+                    : conditions(std::move(conditions)), pieces(std::move(pieces)) {}
+
+            size_t n_outputs() const { return pieces.front().n_outputs(); }
+
+            size_t n_pieces() const { return pieces.size(); }
+
+            /// instructions run for one point of the most expensive piece
+            size_t n_instructions() const {
+                size_t n = 0;
+                for (auto &p: pieces) n = std::max(n, p.n_instructions());
+                return conditions.n_instructions() + n;
+            }
+
+            Workspace workspace() const {
+                Workspace work;
+                work.regs = conditions.workspace();
+                work.cond.resize(chunk * conditions.n_outputs());
+                work.x.resize(chunk);
+                work.out.resize(chunk * n_outputs());
+                work.piece.resize(chunk);
+                work.index.resize(chunk);
+                return work;
+            }
+
+            /// evaluate one point and leave the outputs in the scalar registers
+            /// \param x point
+            /// \param work workspace from workspace()
+            /// \return piece that ran, see output_registers
+            uint32_t evaluate_one(const double x, Workspace &work) const {
+                double *reg = work.regs.scalar.data();
+                if (pieces.size() == 1) {
+                    pieces.front().run_one(x, reg);
+                    return 0;
+                }
+                // read the comparisons straight from the scalar register file
+                conditions.run_one(x, reg);
+                uint32_t p = 0;
+                for (size_t j = 0; j < conditions.outputs.size(); ++j) {
+                    if (reg[conditions.outputs[j]] != 0) p |= 1u << j;
+                }
+                pieces[p].run_one(x, reg);
+                return p;
+            }
+
+            /// register of each output of a piece in Workspace::regs.scalar
+            const uint32_t *output_registers(const uint32_t piece) const {
+                return pieces[piece].outputs.data();
+            }
+
+            /// evaluate all outputs over a batch of points
+            /// \param x points
+            /// \param n number of points
+            /// \param out n * n_outputs() values, row-major by point
+            /// \param work workspace from workspace()
+            void evaluate(const double *x, const size_t n, double *out, Workspace &work) const {
+                if (pieces.size() == 1 && n > 1) {
+                    pieces.front().evaluate(x, n, out, work.regs);
+                    return;
+                }
+                const size_t n_cond = conditions.n_outputs(), n_out = n_outputs();
+                if (n == 1) {
+                    auto reg = output_registers(evaluate_one(*x, work));
+                    for (size_t o = 0; o < n_out; ++o) {
+                        out[o] = work.regs.scalar[reg[o]];
+                    }
+                    return;
+                }
+                constexpr uint32_t done = std::numeric_limits<uint32_t>::max();
+                for (size_t start = 0; start < n; start += chunk) {
+                    const size_t len = std::min(chunk, n - start);
+                    conditions.evaluate(x + start, len, work.cond.data(), work.regs);
+                    bool uniform = true;
+                    for (size_t i = 0; i < len; ++i) {
+                        work.piece[i] = piece_of(&work.cond[i * n_cond], n_cond);
+                        uniform = uniform && work.piece[i] == work.piece[0];
+                    }
+                    if (uniform) {
+                        pieces[work.piece[0]].evaluate(x + start, len, out + start * n_out, work.regs);
+                        continue;
+                    }
+                    // gather the points of one piece at a time, scan cost is len per piece present
+                    for (size_t first = 0; first < len; ++first) {
+                        auto p = work.piece[first];
+                        if (p == done) continue;
+                        size_t m = 0;
+                        for (size_t i = first; i < len; ++i) {
+                            if (work.piece[i] != p) continue;
+                            work.piece[i] = done;
+                            work.index[m] = i;
+                            work.x[m++] = x[start + i];
+                        }
+                        pieces[p].evaluate(work.x.data(), m, work.out.data(), work.regs);
+                        for (size_t j = 0; j < m; ++j) {
+                            std::copy_n(&work.out[j * n_out], n_out, out + (start + work.index[j]) * n_out);
+                        }
+                    }
+                }
+            }
+
+        private:
+            static uint32_t piece_of(const double *c, const size_t n_cond) {
+                uint32_t p = 0;
+                for (size_t j = 0; j < n_cond; ++j) {
+                    if (c[j] != 0) p |= 1u << j;
+                }
+                return p;
+            }
+
+            Tape conditions;
+            std::vector<Tape> pieces;
+        };
+
+        /// compile expressions into one program with CSE across all of them
+        /// \param sources expressions in var
+        /// \param var name of the variable
+        /// \param params named constants
+        /// \param with_derivative also append the derivative of every expression to the outputs
+        inline Program compile(const std::vector<std::string> &sources, const std::string &var,
+                               const std::map<std::string, double> &params = {}, const bool with_derivative = false) {
+            Graph graph;
+            Parser parser(graph, var, params);
+            std::vector<uint32_t> outputs;
+            for (auto &src: sources) {
+                outputs.push_back(parser.parse(src));
+            }
+            if (with_derivative) {
+                std::unordered_map<uint32_t, uint32_t> memo;
+                for (size_t i = 0; i < sources.size(); ++i) {
+                    outputs.push_back(graph.derivative(outputs[i], memo));
+                }
+            }
+            auto conds = graph.comparisons(outputs);
+            if (conds.empty() || conds.size() > Program::max_conditions) {
+                auto tapes = graph.compile({{}, outputs});
+                return {std::move(tapes[0]), {std::move(tapes[1])}};
+            }
+            std::vector<std::vector<uint32_t>> sets{conds};
+            for (uint32_t p = 0; p < (1u << conds.size()); ++p) {
+                std::unordered_map<uint32_t, bool> known;
+                for (size_t j = 0; j < conds.size(); ++j) {
+                    known.emplace(conds[j], (p >> j) & 1);
+                }
+                std::unordered_map<uint32_t, uint32_t> memo;
+                std::vector<uint32_t> piece;
+                for (auto o: outputs) {
+                    piece.push_back(graph.specialize(o, known, memo));
+                }
+                sets.push_back(std::move(piece));
+            }
+            auto tapes = graph.compile(sets);
+            Tape conditions = std::move(tapes.front());
+            tapes.erase(tapes.begin());
+            return {std::move(conditions), std::move(tapes)};
+        }
+    }
+}
+
+/// model defined at runtime by one expression in x per hamiltonian element,
+/// H and dH/dx are evaluated together from a single compiled program
+class ExprModel : public NumericalModel {
+public:
+    /// \param name model name
+    /// \param DoF number of states
+    /// \param x0 start position
+    /// \param left left boundary of the interaction region
+    /// \param right right boundary of the interaction region
+    /// \param elements DoF * DoF expressions in x, row-major
+    /// \param sigma_x_expr expression in k
+    /// \param sigma_p_expr expression in k
+    /// \param params named constants usable in every expression
+    ExprModel(std::string name, const int DoF, const double x0, const double left, const double right,
+              const std::vector<std::string> &elements, const std::string &sigma_x_expr,
+              const std::string &sigma_p_expr, const std::map<std::string, double> &params = {})
+            : program(QUtil::expr::compile(elements, "x", params, true)),
+              sigma_program(QUtil::expr::compile({sigma_x_expr, sigma_p_expr}, "k", params)) {
+        if (elements.size() != static_cast<size_t>(DoF * DoF))
+            throw std::invalid_argument(fmt::format("ExprModel {}: need {} elements, got {}", name, DoF * DoF,
+                                                    elements.size()));
+        this->name = std::move(name);
+        this->DoF = DoF;
+        this->x0 = x0;
+        this->left = left;
+        this->right = right;
+        work = program.workspace();
+        sigma_work = sigma_program.workspace();
+    }
+
+    void hamitonian_cal(gsl_matrix *m, double x) override {
+        update(x);
+        set_matrix(m, program.output_registers(piece));
+    }
+
+    void d_hamitonian_cal(gsl_matrix *m, double x) override {
+        update(x);
+        set_matrix(m, program.output_registers(piece) + DoF * DoF);
+    }
+
+    /// evaluate H and dH/dx over a batch of positions
+    /// \param x positions
+    /// \param n number of positions
+    /// \param out n * 2 * DoF * DoF values, per position H then dH/dx, both row-major
+    void hamitonian_batch(const double *x, const size_t n, double *out) {
+        program.evaluate(x, n, out, work);
+    }
+
+    double sigma_x(double k) override {
+        double s[2];
+        sigma_program.evaluate(&k, 1, s, sigma_work);
+        return s[0];
+    }
+
+    double sigma_p(double k) override {
+        double s[2];
+        sigma_program.evaluate(&k, 1, s, sigma_work);
+        return s[1];
+    }
+
+private:
+    /// H and dH/dx at x stay in the scalar registers until the next position
+    void update(const double x) {
+        if (x == cached_x) return;
+        piece = program.evaluate_one(x, work);
+        cached_x = x;
+    }
+
+    /// \param reg register of each element, row-major
+    void set_matrix(gsl_matrix *m, const uint32_t *reg) const {
+        const double *v = work.regs.scalar.data();
+        for (int i = 0; i < DoF; ++i) {
+            for (int j = 0; j < DoF; ++j) {
+                gsl_matrix_set(m, i, j, v[reg[i * DoF + j]]);
+            }
+        }
+    }
+
+    QUtil::expr::Program program, sigma_program;
+    QUtil::expr::Program::Workspace work, sigma_work;
+    uint32_t piece{};
+    double cached_x{std::numeric_limits<double>::quiet_NaN()};
+};
+
+#endif
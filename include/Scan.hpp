@@ -0,0 +1,460 @@
+#ifndef SCAN_HPP
+#define SCAN_HPP
+
+#include "Model.hpp"
+#include "algorithm"
+#include "atomic"
+#include "csignal"
+#include "cstdint"
+#include "cstdio"
+#include "cstring"
+#include "fstream"
+#include "functional"
+#include "stdexcept"
+#include "string"
+#include "thread"
+#include "vector"
+#include "fmt/core.h"
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+namespace QUtil {
+
+    namespace scan {
+
+        struct WorkUnit {
+            uint32_t model, k_index, batch, attempt;
+            double k;
+        };
+
+        /// fill result[0, width) for one unit, result is zeroed beforehand
+        using Job = std::function<void(NumericalModel &model, const WorkUnit &unit, double *result)>;
+
+        struct ScanConfig {
+            std::vector<double> k;
+            uint32_t n_batch{1};
+            uint32_t width{1};
+            /// worker processes, 0 means one per cpu this process may run on
+            int n_workers{0};
+            /// pin worker i to the cpus of NUMA node i % n_nodes
+            bool numa_pin{true};
+            /// times a unit is re-issued after its worker died
+            uint32_t max_retry{2};
+        };
+
+        /// per (model, k) sums over completed batches
+        struct ScanTable {
+            std::vector<std::string> models;
+            std::vector<double> k;
+            uint32_t n_batch{}, width{};
+            std::vector<uint32_t> count;
+            std::vector<double> sum;
+            uint32_t n_failed{};
+
+            uint32_t &completed(const size_t model, const size_t k_index) {
+                return count[model * k.size() + k_index];
+            }
+
+            double &at(const size_t model, const size_t k_index, const size_t w) {
+                return sum[(model * k.size() + k_index) * width + w];
+            }
+        };
+
+        /// a scan that could not finish because no worker could be started or watched,
+        /// table holds every unit completed before that, the others count as failed
+        class ScanAborted : public std::runtime_error {
+        public:
+            ScanAborted(const std::string &what, ScanTable table)
+                    : std::runtime_error(what), table(std::move(table)) {}
+
+            ScanTable table;
+        };
+
+        namespace detail {
+            /// unit state, a positive value is the pid of the worker that claimed it
+            enum UnitState : int32_t {
+                Pending = 0, Done = -1, Failed = -2
+            };
+
+            struct Unit {
+                std::atomic<int32_t> state;
+                std::atomic<uint32_t> attempt;
+            };
+
+            static_assert(std::atomic<int32_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free &&
+                          std::atomic<uint64_t>::is_always_lock_free, "shared memory atomics must be lock free");
+
+            /// anonymous shared mapping, inherited by every forked worker
+            class SharedRegion {
+            public:
+                SharedRegion(const size_t n_units, const size_t width) : n_units(n_units), width(width) {
+                    size = sizeof(std::atomic<uint64_t>) + n_units * sizeof(Unit) + n_units * width * sizeof(double);
+                    base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+                    if (base == MAP_FAILED)
+                        throw std::runtime_error(fmt::format("scan: mmap of {} bytes failed: {}", size, strerror(errno)));
+                    new(base) std::atomic<uint64_t>(0);
+                    for (size_t i = 0; i < n_units; ++i) {
+                        new(&units()[i]) Unit{{Pending}, {0}};
+                    }
+                }
+
+                SharedRegion(const SharedRegion &) = delete;
+
+                SharedRegion &operator=(const SharedRegion &) = delete;
+
+                ~SharedRegion() { munmap(base, size); }
+
+                std::atomic<uint64_t> &cursor() { return *static_cast<std::atomic<uint64_t> *>(base); }
+
+                Unit *units() {
+                    return reinterpret_cast<Unit *>(static_cast<char *>(base) + sizeof(std::atomic<uint64_t>));
+                }
+
+                double *result(const size_t i) {
+                    return reinterpret_cast<double *>(units() + n_units) + i * width;
+                }
+
+                const size_t n_units, width;
+
+            private:
+                void *base;
+                size_t size;
+            };
+
+            /// parse a sysfs cpu list like "0-3,8-11", malformed items are skipped
+            inline std::vector<int> parse_cpulist(const std::string &s) {
+                std::vector<int> cpus;
+                auto number = [](const std::string &t) {
+                    if (t.empty() || t.find_first_not_of("0123456789") != std::string::npos) return -1;
+                    try {
+                        return std::stoi(t);
+                    } catch (const std::exception &) {
+                        return -1;
+                    }
+                };
+                size_t pos = 0;
+                while (pos < s.size()) {
+                    auto end = s.find(',', pos);
+                    if (end == std::string::npos) end = s.size();
+                    auto item = s.substr(pos, end - pos);
+                    auto dash = item.find('-');
+                    int lo = number(item.substr(0, dash));
+                    int hi = dash == std::string::npos ? lo : number(item.substr(dash + 1));
+                    if (lo >= 0 && hi >= lo) {
+                        for (int c = lo; c <= hi; ++c) cpus.push_back(c);
+                    }
+                    pos = end + 1;
+                }
+                return cpus;
+            }
+
+            /// cpus this process may run on (cgroup cpuset, taskset), empty if unknown
+            inline std::vector<int> allowed_cpus() {
+                std::vector<int> cpus;
+#ifdef __linux__
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+                    for (int c = 0; c < CPU_SETSIZE; ++c) {
+                        if (CPU_ISSET(c, &set)) cpus.push_back(c);
+                    }
+                }
+#endif
+                return cpus;
+            }
+
+            /// allowed cpus of every NUMA node, nodes without one are left out,
+            /// empty if the topology is unavailable
+            /// \param allowed result of allowed_cpus, empty allows every cpu
+            inline std::vector<std::vector<int>> numa_nodes(const std::vector<int> &allowed) {
+                std::vector<std::vector<int>> nodes;
+                for (int n = 0;; ++n) {
+                    std::ifstream file(fmt::format("/sys/devices/system/node/node{}/cpulist", n));
+                    if (!file) break;
+                    std::string line;
+                    std::getline(file, line);
+                    std::vector<int> cpus;
+                    for (auto c: parse_cpulist(line)) {
+                        if (allowed.empty() || std::find(allowed.begin(), allowed.end(), c) != allowed.end())
+                            cpus.push_back(c);
+                    }
+                    if (!cpus.empty()) nodes.push_back(cpus);
+                }
+                return nodes;
+            }
+
+            /// \return 0 on success, otherwise the errno of sched_setaffinity
+            inline int pin_to(const std::vector<int> &cpus) {
+#ifdef __linux__
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                for (auto c: cpus) {
+                    if (c < CPU_SETSIZE) CPU_SET(c, &set);
+                }
+                return sched_setaffinity(0, sizeof(set), &set) == 0 ? 0 : errno;
+#else
+                return ENOSYS;
+#endif
+            }
+
+            inline bool claim(Unit &u, const int32_t pid) {
+                int32_t expected = Pending;
+                return u.state.compare_exchange_strong(expected, pid, std::memory_order_acq_rel);
+            }
+
+            [[noreturn]] inline void worker(SharedRegion &region, const std::vector<NumericalModel *> &models,
+                                            const ScanConfig &config, const Job &job) {
+                const int32_t pid = getpid();
+                const size_t n_k = config.k.size();
+                auto run = [&](size_t i) {
+                    auto &u = region.units()[i];
+                    WorkUnit unit{};
+                    unit.model = i / (n_k * config.n_batch);
+                    unit.k_index = i / config.n_batch % n_k;
+                    unit.batch = i % config.n_batch;
+                    unit.attempt = u.attempt.load(std::memory_order_relaxed);
+                    unit.k = config.k[unit.k_index];
+                    // compute into private memory so a crash never leaves a half written slot marked done
+                    std::vector<double> result(config.width, 0);
+                    job(*models[unit.model], unit, result.data());
+                    std::memcpy(region.result(i), result.data(), config.width * sizeof(double));
+                    u.state.store(Done, std::memory_order_release);
+                };
+                try {
+                    // first pass hands out units in order, later passes pick up units re-issued after a crash
+                    for (uint64_t i; (i = region.cursor().fetch_add(1, std::memory_order_relaxed)) < region.n_units;) {
+                        if (claim(region.units()[i], pid)) run(i);
+                    }
+                    for (size_t i = 0; i < region.n_units; ++i) {
+                        if (claim(region.units()[i], pid)) run(i);
+                    }
+                } catch (const std::exception &e) {
+                    fmt::print(stderr, "scan: worker {} failed: {}\n", pid, e.what());
+                    _exit(1);
+                } catch (...) {
+                    fmt::print(stderr, "scan: worker {} failed: unknown exception\n", pid);
+                    _exit(1);
+                }
+                _exit(0);
+            }
+        }
+
+        /// distribute every (model, k, batch) unit dynamically over forked worker processes,
+        /// units owned by a worker that dies are re-issued up to config.max_retry times,
+        /// a worker that cannot be started is reported and the scan goes on with the others
+        /// \param models models, copied into every worker by fork
+        /// \param config k grid, batches and worker settings
+        /// \param job computes one unit, may throw or crash
+        /// \return sums of each (model, k) over its completed batches
+        /// \throw ScanAborted units are left but no worker is alive to take them, or waitpid failed
+        inline ScanTable run_scan(const std::vector<NumericalModel *> &models, const ScanConfig &config, const Job &job) {
+            const size_t n_units = models.size() * config.k.size() * config.n_batch;
+            detail::SharedRegion region(n_units, config.width);
+            auto units = region.units();
+
+            auto allowed = detail::allowed_cpus();
+            int n_workers = config.n_workers > 0 ? config.n_workers
+                                                 : allowed.empty() ? static_cast<int>(std::thread::hardware_concurrency())
+                                                                   : static_cast<int>(allowed.size());
+            n_workers = static_cast<int>(std::min<size_t>(std::max(n_workers, 1), std::max<size_t>(n_units, 1)));
+            auto nodes = config.numa_pin ? detail::numa_nodes(allowed) : std::vector<std::vector<int>>{};
+
+            // workers share their own process group, so waiting on it never reaps other children of the caller
+            const pid_t parent = getpid();
+            pid_t group = 0;
+            int alive = 0;
+            std::vector<pid_t> workers(n_workers, 0);
+            auto abort_workers = [&] {
+                for (auto &pid: workers) {
+                    if (pid > 0) kill(pid, SIGKILL);
+                }
+                for (auto &pid: workers) {
+                    if (pid <= 0) continue;
+                    while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {}
+                    pid = 0;
+                }
+                alive = 0;
+            };
+            // 0 on success, otherwise the errno of the failed call
+            auto spawn = [&](int slot) {
+                // an empty group is gone once its last member is reaped, start a new one
+                if (alive == 0) group = 0;
+                fflush(nullptr);
+                pid_t pid = fork();
+                if (pid < 0)
+                    return errno;
+                if (pid == 0) {
+                    // nothing may unwind out of the child into the caller's stack
+                    try {
+#ifdef __linux__
+                        // die with the scan, workers no longer get terminal signals sent to the caller's group
+                        prctl(PR_SET_PDEATHSIG, SIGKILL);
+                        if (getppid() != parent) _exit(1);
+#endif
+                        if (setpgid(0, group) != 0) _exit(1);
+                        if (nodes.size() > 1) {
+                            auto &cpus = nodes[slot % nodes.size()];
+                            if (auto error = detail::pin_to(cpus))
+                                fmt::print(stderr, "scan: worker {} cannot pin to the {} cpus of its NUMA node: {}\n",
+                                           getpid(), cpus.size(), strerror(error));
+                        }
+                        detail::worker(region, models, config, job);
+                    } catch (...) {
+                    }
+                    _exit(1);
+                }
+                // set it from both sides, waitpid below must not run before the child joined the group
+                if (setpgid(pid, group == 0 ? pid : group) != 0 && errno != EACCES) {
+                    auto error = errno;
+                    kill(pid, SIGKILL);
+                    while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {}
+                    return error;
+                }
+                if (group == 0) group = pid;
+                workers[slot] = pid;
+                ++alive;
+                return 0;
+            };
+            std::string failure;
+            auto start = [&](int slot) {
+                if (auto error = spawn(slot)) {
+                    failure = fmt::format("scan: cannot start a worker: {}", strerror(error));
+                    fmt::print(stderr, "{}, {} left\n", failure, alive);
+                }
+            };
+            auto has_pending = [&] {
+                for (size_t i = 0; i < n_units; ++i) {
+                    if (units[i].state.load(std::memory_order_acquire) == detail::Pending) return true;
+                }
+                return false;
+            };
+
+            if (n_units > 0) {
+                for (int w = 0; w < n_workers; ++w) start(w);
+            }
+            bool lost = false;
+            while (alive > 0) {
+                int status = 0;
+                pid_t pid = waitpid(-group, &status, 0);
+                if (pid < 0) {
+                    if (errno == EINTR) continue;
+                    // workers that cannot be watched cannot be retried, stop them and keep what is done
+                    failure = fmt::format("scan: waitpid failed: {}", strerror(errno));
+                    abort_workers();
+                    lost = true;
+                    break;
+                }
+                int slot = -1;
+                for (int w = 0; w < n_workers; ++w) {
+                    if (workers[w] == pid) slot = w;
+                }
+                if (slot < 0) continue;
+                workers[slot] = 0;
+                --alive;
+                // a live worker never owns a unit claimed by a dead one, so the reset cannot race
+                for (size_t i = 0; i < n_units; ++i) {
+                    auto &u = units[i];
+                    if (u.state.load(std::memory_order_acquire) != pid)
+                        continue;
+                    auto attempt = u.attempt.load(std::memory_order_relaxed) + 1;
+                    u.attempt.store(attempt, std::memory_order_relaxed);
+                    u.state.store(attempt > config.max_retry ? detail::Failed : detail::Pending,
+                                  std::memory_order_release);
+                }
+                if (has_pending()) start(slot);
+            }
+
+            ScanTable table;
+            for (auto m: models) table.models.push_back(m->name);
+            table.k = config.k;
+            table.n_batch = config.n_batch;
+            table.width = config.width;
+            table.count.assign(models.size() * config.k.size(), 0);
+            table.sum.assign(models.size() * config.k.size() * config.width, 0);
+            for (size_t i = 0; i < n_units; ++i) {
+                auto state = units[i].state.load(std::memory_order_acquire);
+                if (state != detail::Done) {
+                    ++table.n_failed;
+                    continue;
+                }
+                size_t cell = i / config.n_batch;
+                ++table.count[cell];
+                auto r = region.result(i);
+                for (size_t w = 0; w < config.width; ++w) {
+                    table.sum[cell * config.width + w] += r[w];
+                }
+            }
+            if (lost || has_pending())
+                throw ScanAborted(failure, std::move(table));
+            return table;
+        }
+
+        constexpr char table_magic[8] = {'Q', 'U', 'S', 'C', 'A', 'N', '0', '1'};
+
+        /// binary layout: magic, n_models, n_k, n_batch, width, n_failed (uint32),
+        /// model names (uint32 length + bytes), k grid, count, sum
+        inline void write_table(const std::string &path, const ScanTable &table) {
+            std::ofstream file(path, std::ios::binary);
+            if (!file)
+                throw std::runtime_error(fmt::format("scan: cannot open {}", path));
+            auto put = [&](const void *p, size_t n) { file.write(static_cast<const char *>(p), n); };
+            auto put_u32 = [&](uint32_t v) { put(&v, sizeof(v)); };
+            put(table_magic, sizeof(table_magic));
+            put_u32(table.models.size());
+            put_u32(table.k.size());
+            put_u32(table.n_batch);
+            put_u32(table.width);
+            put_u32(table.n_failed);
+            for (auto &name: table.models) {
+                put_u32(name.size());
+                put(name.data(), name.size());
+            }
+            put(table.k.data(), table.k.size() * sizeof(double));
+            put(table.count.data(), table.count.size() * sizeof(uint32_t));
+            put(table.sum.data(), table.sum.size() * sizeof(double));
+            if (!file)
+                throw std::runtime_error(fmt::format("scan: write to {} failed", path));
+        }
+
+        inline ScanTable read_table(const std::string &path) {
+            std::ifstream file(path, std::ios::binary);
+            if (!file)
+                throw std::runtime_error(fmt::format("scan: cannot open {}", path));
+            auto get = [&](void *p, size_t n) {
+                if (!file.read(static_cast<char *>(p), n))
+                    throw std::runtime_error(fmt::format("scan: {} is truncated", path));
+            };
+            auto get_u32 = [&] {
+                uint32_t v;
+                get(&v, sizeof(v));
+                return v;
+            };
+            char magic[sizeof(table_magic)];
+            get(magic, sizeof(magic));
+            if (memcmp(magic, table_magic, sizeof(magic)) != 0)
+                throw std::runtime_error(fmt::format("scan: {} is not a scan table", path));
+            ScanTable table;
+            table.models.resize(get_u32());
+            table.k.resize(get_u32());
+            table.n_batch = get_u32();
+            table.width = get_u32();
+            table.n_failed = get_u32();
+            for (auto &name: table.models) {
+                name.resize(get_u32());
+                get(name.data(), name.size());
+            }
+            get(table.k.data(), table.k.size() * sizeof(double));
+            table.count.resize(table.models.size() * table.k.size());
+            get(table.count.data(), table.count.size() * sizeof(uint32_t));
+            table.sum.resize(table.count.size() * table.width);
+            get(table.sum.data(), table.sum.size() * sizeof(double));
+            return table;
+        }
+    }
+}
+#endif
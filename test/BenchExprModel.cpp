@@ -0,0 +1,62 @@
+#include "QUtil.hpp"
+#include "Model.hpp"
+#include "ExprModel.hpp"
+#include "ExprModels.hpp"
+#include "gtest/gtest.h"
+#include "algorithm"
+#include "chrono"
+#include "fmt/core.h"
+
+using namespace QUtil::gslextra;
+
+/// median over interleaved runs of expression model time / handwritten model time,
+/// H then dH/dx per position through NumericalModel, the way models are used
+TEST(ExprModel, WithinTwiceHandwritten) {
+    NumericalModel *models[]{new SAC(), new DAC(), new ECR(), new DBG(), new DAG(), new DRN()};
+    auto expr_models = make_expr_models();
+    auto h = make_shared_matrix_ptr(2, 2);
+    const size_t n = 200000;
+    const int runs = 21;
+    std::vector<double> x(n), out(n * 8);
+    double sink = 0;
+
+    auto seconds = [](auto &&f) {
+        auto t0 = std::chrono::steady_clock::now();
+        f();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    };
+    auto single = [&](NumericalModel &m) {
+        for (size_t i = 0; i < n; ++i) {
+            m.hamitonian_cal(h.get(), x[i]);
+            sink += gsl_matrix_get(h.get(), 0, 1);
+            m.d_hamitonian_cal(h.get(), x[i]);
+            sink += gsl_matrix_get(h.get(), 0, 1);
+        }
+    };
+    auto median = [](std::vector<double> v) {
+        std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+        return v[v.size() / 2];
+    };
+    for (int i = 0; i < 6; ++i) {
+        auto &e = expr_models[i];
+        for (size_t j = 0; j < n; ++j) {
+            x[j] = (e.right - e.left + 10) / n * j + e.left - 5;
+        }
+        // the two paths are timed in separate loops, so neither runs right after a cache-cold batch sweep
+        std::vector<double> single_ratio, batch_ratio;
+        for (int r = 0; r < runs; ++r) {
+            double hand = seconds([&] { single(*models[i]); });
+            single_ratio.push_back(seconds([&] { single(e); }) / hand);
+        }
+        for (int r = 0; r < runs; ++r) {
+            double hand = seconds([&] { single(*models[i]); });
+            batch_ratio.push_back(seconds([&] { e.hamitonian_batch(x.data(), n, out.data()); }) / hand);
+            sink += out[1];
+        }
+        auto s = median(single_ratio), b = median(batch_ratio);
+        fmt::print("{} single {:.2f}x batch {:.2f}x of handwritten\n", e.name, s, b);
+        EXPECT_LT(s, 2.0) << e.name;
+        EXPECT_LT(b, 2.0) << e.name;
+    }
+    EXPECT_TRUE(std::isfinite(sink));
+}
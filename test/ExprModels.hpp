@@ -0,0 +1,32 @@
+#ifndef EXPRMODELS_HPP
+#define EXPRMODELS_HPP
+
+#include "ExprModel.hpp"
+
+/// the handwritten models of Model.hpp as expressions, in the order SAC, DAC, ECR, DBG, DAG, DRN
+inline std::vector<ExprModel> make_expr_models() {
+    std::string sac = "x > 0 ? 0.01 * (1 - exp(-1.6 * x)) : -0.01 * (1 - exp(1.6 * x))";
+    std::string sac12 = "0.005 * exp(-x * x)";
+    std::string dac12 = "0.015 * exp(-0.06 * x * x)";
+    std::string ecr12 = "x < 0 ? 0.1 * exp(0.9 * x) : 0.1 * (2 - exp(-0.9 * x))";
+    std::string dbg12 = "x < -z ? b * exp(c * (x - z)) + b * (2 - exp(c * (x + z))) : "
+                        "x < z ? b * exp(c * (x - z)) + b * exp(-c * (x + z)) : "
+                        "b * exp(-c * (x + z)) + b * (2 - exp(-c * (x - z)))";
+    std::string dag12 = "x < -z ? -b * exp(c * (x - z)) + b * exp(c * (x + z)) : "
+                        "x < z ? -b * exp(c * (x - z)) - b * exp(-c * (x + z)) + 2 * b : "
+                        "b * exp(-c * (x - z)) - b * exp(-c * (x + z))";
+    std::string drn12 = "0.03 * (exp(-3.2 * (x - 2) * (x - 2)) + exp(-3.2 * (x + 2) * (x + 2)))";
+    return {
+            ExprModel("SAC", 2, -17.5, -10, 10, {sac, sac12, sac12, "-(" + sac + ")"}, "10 / k", "k / 20"),
+            ExprModel("DAC", 2, -17.5, -15, 15, {"0", dac12, dac12, "-0.1 * exp(-0.28 * x * x) + 0.05"},
+                      "10 / k", "k / 20"),
+            ExprModel("ECR", 2, -17.5, -15, 15, {"6e-4", ecr12, ecr12, "-6e-4"}, "10 / k", "k / 20"),
+            ExprModel("DBG", 2, -22.5, -20, 20, {"6e-4", dbg12, dbg12, "-6e-4"}, "3 * sqrt(2) / 2",
+                      "1 / 3.0 / sqrt(2)", {{"b", 0.1}, {"c", 0.9}, {"z", 10}}),
+            ExprModel("DAG", 2, -27.5, -20, 20, {"6e-4", dag12, dag12, "-6e-4"}, "2", "0.25",
+                      {{"b", 0.1}, {"c", 0.9}, {"z", 4}}),
+            ExprModel("DRN", 2, -12.5, -10, 10, {"0", drn12, drn12, "0.01"}, "0.5", "1.0"),
+    };
+}
+
+#endif
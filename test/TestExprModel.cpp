@@ -0,0 +1,152 @@
+#include "QUtil.hpp"
+#include "Model.hpp"
+#include "ExprModel.hpp"
+#include "ExprModels.hpp"
+#include "gtest/gtest.h"
+#include "cstring"
+#include "fmt/core.h"
+
+using namespace QUtil::gslextra;
+using namespace QUtil::expr;
+
+static uint64_t bits(double v) {
+    uint64_t b;
+    std::memcpy(&b, &v, sizeof(b));
+    return b;
+}
+
+TEST(ExprModel, ReproduceModels) {
+    NumericalModel *models[]{new SAC(), new DAC(), new ECR(), new DBG(), new DAG(), new DRN()};
+    auto expr_models = make_expr_models();
+
+    auto h = make_shared_matrix_ptr(2, 2);
+    auto h_expr = make_shared_matrix_ptr(2, 2);
+
+    for (int i = 0; i < 6; ++i) {
+        auto m = models[i];
+        auto &e = expr_models[i];
+        EXPECT_EQ(m->name, e.name);
+        EXPECT_EQ(m->x0, e.x0);
+        EXPECT_EQ(m->left, e.left);
+        EXPECT_EQ(m->right, e.right);
+        for (double k: {5.0, 10.0, 30.0}) {
+            EXPECT_DOUBLE_EQ(m->sigma_x(k), e.sigma_x(k));
+            EXPECT_DOUBLE_EQ(m->sigma_p(k), e.sigma_p(k));
+        }
+        for (int n = 0; n <= 1000; ++n) {
+            double x = (m->right - m->left + 10) / 1000 * n + m->left - 5;
+            m->hamitonian_cal(h.get(), x);
+            e.hamitonian_cal(h_expr.get(), x);
+            for (int r = 0; r < 2; ++r) {
+                for (int c = 0; c < 2; ++c) {
+                    EXPECT_EQ(bits(gsl_matrix_get(h.get(), r, c)), bits(gsl_matrix_get(h_expr.get(), r, c)))
+                                        << m->name << " H at " << x;
+                }
+            }
+            m->d_hamitonian_cal(h.get(), x);
+            e.d_hamitonian_cal(h_expr.get(), x);
+            for (int r = 0; r < 2; ++r) {
+                for (int c = 0; c < 2; ++c) {
+                    EXPECT_NEAR(gsl_matrix_get(h.get(), r, c), gsl_matrix_get(h_expr.get(), r, c), 1e-14)
+                                        << m->name << " dH at " << x;
+                }
+            }
+        }
+    }
+}
+
+TEST(ExprModel, Batch) {
+    auto models = make_expr_models();
+    auto h = make_shared_matrix_ptr(2, 2);
+    auto dh = make_shared_matrix_ptr(2, 2);
+    const size_t n = 2 * Tape::block + 7;
+    std::vector<double> x(n), out(n * 8);
+
+    for (auto &m: models) {
+        for (size_t i = 0; i < n; ++i) {
+            x[i] = (m.right - m.left) / n * i + m.left;
+        }
+        m.hamitonian_batch(x.data(), n, out.data());
+        for (size_t i = 0; i < n; ++i) {
+            m.hamitonian_cal(h.get(), x[i]);
+            m.d_hamitonian_cal(dh.get(), x[i]);
+            for (int j = 0; j < 4; ++j) {
+                EXPECT_EQ(bits(h->data[j]), bits(out[i * 8 + j]));
+                EXPECT_EQ(bits(dh->data[j]), bits(out[i * 8 + 4 + j]));
+            }
+        }
+    }
+}
+
+TEST(expr, derivative) {
+    auto tape = compile({"x ^ 3", "sqrt(x) * log(x)", "sin(x) / cos(x)", "x < 1 ? 2 * x : x * x"}, "x", {}, true);
+    std::vector<double> x{0.5, 2.0}, out(2 * 8);
+    auto work = tape.workspace();
+    tape.evaluate(x.data(), x.size(), out.data(), work);
+    for (int i = 0; i < 2; ++i) {
+        double v = x[i], *o = &out[i * 8];
+        EXPECT_DOUBLE_EQ(v * v * v, o[0]);
+        EXPECT_DOUBLE_EQ(sqrt(v) * log(v), o[1]);
+        EXPECT_DOUBLE_EQ(tan(v), o[2]);
+        EXPECT_DOUBLE_EQ(v < 1 ? 2 * v : v * v, o[3]);
+        EXPECT_DOUBLE_EQ(3 * v * v, o[4]);
+        EXPECT_DOUBLE_EQ(log(v) / 2 / sqrt(v) + 1 / sqrt(v), o[5]);
+        EXPECT_DOUBLE_EQ(1 / cos(v) / cos(v), o[6]);
+        EXPECT_DOUBLE_EQ(v < 1 ? 2 : 2 * v, o[7]);
+    }
+}
+
+TEST(expr, fold) {
+    // 0 / x is not folded to 0, it must stay NaN at x == 0
+    auto tape = compile({"0 / x", "x * 1 - 0"}, "x");
+    double x = 0, out[2];
+    auto work = tape.workspace();
+    tape.evaluate(&x, 1, out, work);
+    EXPECT_TRUE(std::isnan(out[0]));
+    EXPECT_EQ(0, out[1]);
+    // the division is the only instruction, x * 1 - 0 is x itself
+    EXPECT_EQ(1, tape.n_instructions());
+}
+
+TEST(expr, common_subexpression) {
+    // exp(-x * x) is computed once and shared by both outputs and the derivative
+    auto tape = compile({"0.5 * exp(-x * x)", "exp(-x * x) + 1"}, "x", {}, true);
+    // neg, mul, exp, two scaled outputs and the derivative chain
+    EXPECT_LE(tape.n_instructions(), 10);
+    auto single = compile({"exp(-x * x)", "exp(-x * x)"}, "x");
+    // neg, then exp of the product fused into one instruction
+    EXPECT_EQ(2, single.n_instructions());
+}
+
+TEST(expr, pieces) {
+    // one tape per outcome of the two comparisons, each runs only its own branch
+    auto dbg = compile({"x < -1 ? exp(x) : x < 1 ? exp(2 * x) : exp(3 * x)"}, "x", {}, true);
+    EXPECT_EQ(4, dbg.n_pieces());
+    EXPECT_LE(dbg.n_instructions(), 2 + 4);
+    std::vector<double> x{-2, 0.5, -3, 2, 0.25}, out(x.size() * 2);
+    auto work = dbg.workspace();
+    dbg.evaluate(x.data(), x.size(), out.data(), work);
+    for (size_t i = 0; i < x.size(); ++i) {
+        double k = x[i] < -1 ? 1 : x[i] < 1 ? 2 : 3;
+        EXPECT_DOUBLE_EQ(exp(k * x[i]), out[i * 2]);
+        EXPECT_DOUBLE_EQ(k * exp(k * x[i]), out[i * 2 + 1]);
+    }
+
+    // too many comparisons fall back to evaluating every branch on one tape
+    std::string many = "0";
+    for (int i = 9; i >= 0; --i) many = fmt::format("x < {} ? {} : ({})", i, i, many);
+    auto flat = compile({many}, "x");
+    EXPECT_EQ(1, flat.n_pieces());
+    double v = 4.5, r;
+    auto flat_work = flat.workspace();
+    flat.evaluate(&v, 1, &r, flat_work);
+    EXPECT_EQ(5, r);
+}
+
+TEST(expr, error) {
+    EXPECT_THROW(compile({"x +"}, "x"), std::invalid_argument);
+    EXPECT_THROW(compile({"y * 2"}, "x"), std::invalid_argument);
+    EXPECT_THROW(compile({"x < 0 ? 1"}, "x"), std::invalid_argument);
+    EXPECT_THROW(compile({"exp(x"}, "x"), std::invalid_argument);
+    EXPECT_THROW(ExprModel("bad", 2, 0, -1, 1, {"x"}, "1", "1"), std::invalid_argument);
+}
@@ -0,0 +1,196 @@
+#include "Model.hpp"
+#include "Scan.hpp"
+#include "gtest/gtest.h"
+#include "unistd.h"
+#include "filesystem"
+#include "atomic"
+#include "functional"
+#include "sys/mman.h"
+#include "sys/resource.h"
+
+using namespace QUtil::scan;
+
+TEST(scan, models) {
+    std::vector<NumericalModel *> models{new SAC(), new DAC(), new ECR(), new DBG(), new DAG(), new DRN()};
+    ScanConfig config;
+    config.k = {10, 20, 30};
+    config.n_batch = 5;
+    config.width = 3;
+    config.n_workers = 4;
+
+    auto table = run_scan(models, config, [](NumericalModel &m, const WorkUnit &unit, double *result) {
+        result[0] = 1;
+        result[1] = m.sigma_x(unit.k);
+        result[2] = unit.batch;
+    });
+    auto path = std::filesystem::temp_directory_path() / fmt::format("qutil_scan_{}.bin", getpid());
+    write_table(path.string(), table);
+    auto read = read_table(path.string());
+    std::filesystem::remove(path);
+
+    EXPECT_EQ(0, read.n_failed);
+    EXPECT_EQ(table.models, read.models);
+    EXPECT_EQ(config.k, read.k);
+    for (size_t m = 0; m < models.size(); ++m) {
+        EXPECT_EQ(models[m]->name, read.models[m]);
+        for (size_t k = 0; k < config.k.size(); ++k) {
+            EXPECT_EQ(5, read.completed(m, k));
+            EXPECT_DOUBLE_EQ(5, read.at(m, k, 0));
+            EXPECT_DOUBLE_EQ(5 * models[m]->sigma_x(config.k[k]), read.at(m, k, 1));
+            EXPECT_DOUBLE_EQ(10, read.at(m, k, 2));
+        }
+    }
+}
+
+TEST(scan, worker_failure) {
+    std::vector<NumericalModel *> models{new SAC(), new DRN()};
+    ScanConfig config;
+    config.k = {10, 20};
+    config.n_batch = 4;
+    config.n_workers = 2;
+    config.max_retry = 1;
+
+    auto table = run_scan(models, config, [](NumericalModel &, const WorkUnit &unit, double *result) {
+        // one unit kills its worker once and succeeds when re-issued, another never succeeds
+        if (unit.model == 0 && unit.k_index == 1 && unit.batch == 2 && unit.attempt == 0) _exit(3);
+        if (unit.model == 1 && unit.k_index == 0 && unit.batch == 1) throw std::runtime_error("bad unit");
+        result[0] = unit.k;
+    });
+
+    EXPECT_EQ(1, table.n_failed);
+    EXPECT_EQ(4, table.completed(0, 1));
+    EXPECT_DOUBLE_EQ(4 * 20, table.at(0, 1, 0));
+    EXPECT_EQ(3, table.completed(1, 0));
+    EXPECT_DOUBLE_EQ(3 * 10, table.at(1, 0, 0));
+    EXPECT_EQ(4, table.completed(1, 1));
+}
+
+TEST(scan, other_children) {
+    // a child of the caller that exits during the scan is left for the caller to reap
+    pid_t other = fork();
+    ASSERT_LE(0, other);
+    if (other == 0) _exit(7);
+    std::vector<NumericalModel *> models{new SAC()};
+    ScanConfig config;
+    config.k = {10, 20};
+    config.n_batch = 2;
+    config.n_workers = 2;
+    config.max_retry = 0;
+
+    auto table = run_scan(models, config, [](NumericalModel &, const WorkUnit &unit, double *result) {
+        usleep(10000);
+        // exceptions not derived from std::exception end the worker as well
+        if (unit.k_index == 1 && unit.batch == 0) throw 1;
+        result[0] = 1;
+    });
+
+    EXPECT_EQ(1, table.n_failed);
+    int status = 0;
+    ASSERT_EQ(other, waitpid(other, &status, 0));
+    EXPECT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(7, WEXITSTATUS(status));
+}
+
+/// run body in a child process that RLIMIT_NPROC applies to, so a job can make the next fork fail
+static void in_limited_process(const std::function<void()> &body) {
+    pid_t pid = fork();
+    ASSERT_LE(0, pid);
+    if (pid == 0) {
+        // root ignores RLIMIT_NPROC
+        if (geteuid() == 0 && (setgid(65534) != 0 || setuid(65534) != 0)) _exit(2);
+        try {
+            body();
+        } catch (const std::exception &e) {
+            ADD_FAILURE() << e.what();
+        }
+        // never return into the test runner from the child
+        _exit(::testing::Test::HasFailure() ? 1 : 0);
+    }
+    int status = 0;
+    ASSERT_EQ(pid, waitpid(pid, &status, 0));
+    ASSERT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(0, WEXITSTATUS(status));
+}
+
+/// lower the scan's process limit, then kill this worker
+static void exhaust_and_die() {
+    rlimit one{1, 1};
+    prlimit(getppid(), RLIMIT_NPROC, &one, nullptr);
+    _exit(3);
+}
+
+TEST(scan, respawn_failure) {
+    // the replacement of a dead worker cannot be forked, the other worker picks up its unit
+    in_limited_process([] {
+        std::vector<NumericalModel *> models{new SAC()};
+        ScanConfig config;
+        config.k = {10};
+        config.n_batch = 8;
+        config.n_workers = 2;
+        // jobs started by any worker, so the limit drops only after both workers were forked
+        auto started = static_cast<std::atomic<int> *>(
+                mmap(nullptr, sizeof(std::atomic<int>), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+        ASSERT_NE(MAP_FAILED, static_cast<void *>(started));
+        new(started) std::atomic<int>(0);
+
+        auto table = run_scan(models, config, [=](NumericalModel &, const WorkUnit &unit, double *result) {
+            started->fetch_add(1);
+            if (unit.batch == 0 && unit.attempt == 0) {
+                while (started->load() < 2) usleep(1000);
+                exhaust_and_die();
+            }
+            usleep(20000);
+            result[0] = 1;
+        });
+        munmap(started, sizeof(std::atomic<int>));
+        EXPECT_EQ(0, table.n_failed);
+        EXPECT_EQ(8, table.completed(0, 0));
+        EXPECT_DOUBLE_EQ(8, table.at(0, 0, 0));
+    });
+}
+
+TEST(scan, no_worker_left) {
+    // the only worker dies and cannot be replaced, the units it completed are kept
+    in_limited_process([] {
+        std::vector<NumericalModel *> models{new SAC()};
+        ScanConfig config;
+        config.k = {10};
+        config.n_batch = 6;
+        config.n_workers = 1;
+
+        try {
+            run_scan(models, config, [](NumericalModel &, const WorkUnit &unit, double *result) {
+                if (unit.batch == 3) exhaust_and_die();
+                result[0] = unit.batch;
+            });
+            ADD_FAILURE() << "scan finished without a worker";
+        } catch (ScanAborted &e) {
+            EXPECT_EQ(3, e.table.n_failed);
+            EXPECT_EQ(3, e.table.completed(0, 0));
+            EXPECT_DOUBLE_EQ(0 + 1 + 2, e.table.at(0, 0, 0));
+        }
+    });
+}
+
+TEST(scan, cpulist) {
+    using QUtil::scan::detail::parse_cpulist;
+    EXPECT_EQ((std::vector<int>{0, 1, 2, 3, 8, 9, 10, 11}), parse_cpulist("0-3,8-11"));
+    EXPECT_EQ(std::vector<int>{5}, parse_cpulist("5"));
+    EXPECT_TRUE(parse_cpulist("").empty());
+    // malformed items are skipped, the rest of the list is kept
+    EXPECT_EQ((std::vector<int>{1, 7}), parse_cpulist("1,x,3-,-2,4x,5-4,1-2-3,,99999999999,7"));
+}
+
+TEST(scan, numa_nodes) {
+    using namespace QUtil::scan::detail;
+    auto allowed = allowed_cpus();
+    ASSERT_FALSE(allowed.empty());
+    // node cpu lists are cut down to the allowed ones, nodes left empty are dropped
+    for (auto &node: numa_nodes(allowed)) {
+        ASSERT_FALSE(node.empty());
+        for (auto c: node) EXPECT_NE(allowed.end(), std::find(allowed.begin(), allowed.end(), c)) << c;
+    }
+    EXPECT_TRUE(numa_nodes({-1}).empty());
+    EXPECT_EQ(EINVAL, pin_to({}));
+    EXPECT_EQ(0, pin_to(allowed));
+}